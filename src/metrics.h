@@ -0,0 +1,202 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+
+uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class Counter {
+    std::atomic<uint64_t> value{0};
+
+public:
+    void Add(uint64_t delta = 1) {
+        value.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    uint64_t Get() const {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+class Gauge {
+    std::atomic<int64_t> value{0};
+
+public:
+    void Add(int64_t delta) {
+        value.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    void Set(int64_t new_value) {
+        value.store(new_value, std::memory_order_relaxed);
+    }
+
+    int64_t Get() const {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+// Log-linear buckets: every power of two is split into SUB_COUNT equal parts,
+// so any recorded value is reported with relative error below 1 / SUB_COUNT.
+class Histogram {
+    static const int SUB_BITS = 4;
+    static const uint64_t SUB_COUNT = 1 << SUB_BITS;
+    static const size_t N_BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    std::array<std::atomic<uint64_t>, N_BUCKETS> buckets{};
+    std::atomic<uint64_t> count{0}, sum{0}, max{0};
+
+    static size_t BucketIndex(uint64_t value) {
+        if (value < SUB_COUNT) {
+            return value;
+        }
+        int shift = std::bit_width(value) - 1 - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + ((value >> shift) - SUB_COUNT);
+    }
+
+    static uint64_t BucketUpperBound(size_t index) {
+        if (index < SUB_COUNT) {
+            return index;
+        }
+        int shift = index / SUB_COUNT - 1;
+        return ((SUB_COUNT + index % SUB_COUNT + 1) << shift) - 1;
+    }
+
+public:
+    void Record(uint64_t value) {
+        buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t cur_max = max.load(std::memory_order_relaxed);
+        while (value > cur_max && !max.compare_exchange_weak(cur_max, value, std::memory_order_relaxed)) {}
+    }
+
+    void RecordSince(uint64_t start_ns) {
+        Record(NowNs() - start_ns);
+    }
+
+    uint64_t GetCount() const {
+        return count.load(std::memory_order_relaxed);
+    }
+
+    uint64_t GetSum() const {
+        return sum.load(std::memory_order_relaxed);
+    }
+
+    uint64_t GetMax() const {
+        return max.load(std::memory_order_relaxed);
+    }
+
+    uint64_t ValueAtQuantile(double q) const {
+        std::array<uint64_t, N_BUCKETS> snapshot;
+        uint64_t total = 0;
+        for (size_t i = 0; i < N_BUCKETS; ++i) {
+            snapshot[i] = buckets[i].load(std::memory_order_relaxed);
+            total += snapshot[i];
+        }
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, q * total + 0.5);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < N_BUCKETS; ++i) {
+            seen += snapshot[i];
+            if (seen >= rank) {
+                return std::min(BucketUpperBound(i), GetMax());
+            }
+        }
+        return GetMax();
+    }
+};
+
+class Metrics {
+    static constexpr std::pair<double, const char *> QUANTILES[] = {
+            {0.5, "0.5"}, {0.9, "0.9"}, {0.99, "0.99"}, {0.999, "0.999"}};
+
+    template<class T>
+    struct Series {
+        std::string labels;
+        T metric;
+
+        explicit Series(std::string labels) : labels(std::move(labels)) {}
+    };
+
+    template<class T>
+    using Family = std::map<std::string, std::deque<Series<T>>>;
+
+    Family<Counter> counters;
+    Family<Gauge> gauges;
+    Family<Histogram> histograms;
+
+    static std::string Name(const std::string &name, const std::string &labels,
+                            const std::string &extra_label = "") {
+        std::string all_labels = labels;
+        if (!extra_label.empty()) {
+            all_labels += (all_labels.empty() ? "" : ",") + extra_label;
+        }
+        return all_labels.empty() ? name : name + "{" + all_labels + "}";
+    }
+
+    static std::string Seconds(uint64_t ns) {
+        std::ostringstream out;
+        out << ns / 1'000'000'000 << '.' << std::setw(9) << std::setfill('0') << ns % 1'000'000'000;
+        return out.str();
+    }
+
+public:
+    Counter &AddCounter(const std::string &name, const std::string &labels = "") {
+        return counters[name].emplace_back(labels).metric;
+    }
+
+    Gauge &AddGauge(const std::string &name, const std::string &labels = "") {
+        return gauges[name].emplace_back(labels).metric;
+    }
+
+    Histogram &AddHistogram(const std::string &name, const std::string &labels = "") {
+        return histograms[name].emplace_back(labels).metric;
+    }
+
+    std::string Render() const {
+        std::ostringstream out;
+        for (const auto &[name, series]: counters) {
+            out << "# TYPE " << name << " counter\n";
+            for (const auto &[labels, counter]: series) {
+                out << Name(name, labels) << ' ' << counter.Get() << '\n';
+            }
+        }
+        for (const auto &[name, series]: gauges) {
+            out << "# TYPE " << name << " gauge\n";
+            for (const auto &[labels, gauge]: series) {
+                out << Name(name, labels) << ' ' << gauge.Get() << '\n';
+            }
+        }
+        for (const auto &[name, series]: histograms) {
+            out << "# TYPE " << name << " summary\n";
+            for (const auto &[labels, histogram]: series) {
+                for (const auto &[q, q_label]: QUANTILES) {
+                    out << Name(name, labels, std::string("quantile=\"") + q_label + "\"") << ' '
+                        << Seconds(histogram.ValueAtQuantile(q)) << '\n';
+                }
+                out << Name(name + "_sum", labels) << ' ' << Seconds(histogram.GetSum()) << '\n';
+                out << Name(name + "_count", labels) << ' ' << histogram.GetCount() << '\n';
+            }
+            out << "# TYPE " << name << "_max gauge\n";
+            for (const auto &[labels, histogram]: series) {
+                out << Name(name + "_max", labels) << ' ' << Seconds(histogram.GetMax()) << '\n';
+            }
+        }
+        return out.str();
+    }
+};
@@ -76,8 +76,10 @@ class HostRandom : public Host {
     size_t answer_id;
 
 public:
-    HostRandom() {
-        std::mt19937 rnd(clock());
+    HostRandom() : HostRandom(clock()) {}
+
+    explicit HostRandom(std::mt19937::result_type seed) {
+        std::mt19937 rnd(seed);
         answer_id = rnd() % answers.size();
     }
 
@@ -96,7 +98,9 @@ class HostHater : public Host {
     std::mt19937 rnd;
 
 public:
-    explicit HostHater(double randomness) : randomness(randomness), rnd(clock()) {
+    explicit HostHater(double randomness) : HostHater(randomness, clock()) {}
+
+    HostHater(double randomness, std::mt19937::result_type seed) : randomness(randomness), rnd(seed) {
         possible_answers.resize(answers.size());
         for (size_t answer_id = 0; answer_id < answers.size(); ++answer_id) {
             possible_answers[answer_id] = answer_id;
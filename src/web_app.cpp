@@ -1,28 +1,135 @@
 #include <algorithm>
+#include <cstdint>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <random>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <App.h>
 
+#include "metrics.h"
 #include "players.h"
 
 const int PORT = 3000;
 const int MAX_MOVES = 6;
+const int LOOP_PROBE_MS = 100;
+const uint64_t LOOP_STALL_NS = 50'000'000;
+
+// Binary protocol, selected with the "wordle.binary" websocket subprotocol. Each binary frame
+// is a batch of guesses: u32 game id, u16 guess id (little-endian). The reply is a single frame
+// with one result per guess: u32 game id, u8 pattern, u16 guess id of the answer once the game
+// is over (NO_ANSWER otherwise). A game is started (or restarted) by guessing NEW_GAME_GUESS,
+// answered with GAME_STARTED_PAT; guesses for ids without a live game, including games that
+// have just finished, get INVALID_PAT. A frame holds 1 to BINARY_MAX_GUESSES guesses: empty or
+// misaligned frames are closed with 1002, and larger frames exceed maxPayloadLength, so uWS
+// drops the connection without a close frame (1006). A connection keeps at most
+// BINARY_MAX_GAMES live games, starting more gets GAME_LIMIT_PAT. Moves are applied before the
+// reply is sent, so a client that lets more than BINARY_MAX_BACKPRESSURE bytes of replies pile
+// up is closed with 1008 rather than having a reply silently dropped.
+const std::string BINARY_PROTOCOL = "wordle.binary";
+const size_t BINARY_GUESS_SIZE = 6;
+const size_t BINARY_RESULT_SIZE = 7;
+const size_t BINARY_MAX_GUESSES = 256;
+const size_t BINARY_MAX_GAMES = 64;
+const size_t BINARY_MAX_BACKPRESSURE = 64 * 1024;
+const u_char INVALID_PAT = 255;
+const u_char GAME_LIMIT_PAT = 254;
+const u_char GAME_STARTED_PAT = 253;
+const uint16_t NEW_GAME_GUESS = 0xffff;
+const uint16_t NO_ANSWER = 0xffff;
+
+struct ModeMetrics {
+    Histogram &upgrade_latency, &message_latency, &binary_message_latency, &move_latency;
+    Counter &games_started, &games_won, &games_lost, &invalid_guesses;
+
+    ModeMetrics(Metrics &metrics, const std::string &mode) : ModeMetrics(metrics, Label{"mode=\"" + mode + "\""}) {}
+
+private:
+    struct Label {
+        std::string mode;
+    };
+
+    ModeMetrics(Metrics &metrics, const Label &label)
+            : upgrade_latency(metrics.AddHistogram("wordle_ws_upgrade_seconds", label.mode)),
+              message_latency(metrics.AddHistogram("wordle_ws_message_seconds", label.mode + ",protocol=\"text\"")),
+              binary_message_latency(metrics.AddHistogram("wordle_ws_message_seconds",
+                                                          label.mode + ",protocol=\"binary\"")),
+              move_latency(metrics.AddHistogram("wordle_host_move_seconds", label.mode)),
+              games_started(metrics.AddCounter("wordle_games_started_total", label.mode)),
+              games_won(metrics.AddCounter("wordle_games_won_total", label.mode)),
+              games_lost(metrics.AddCounter("wordle_games_lost_total", label.mode)),
+              invalid_guesses(metrics.AddCounter("wordle_invalid_guesses_total", label.mode)) {}
+};
 
 struct GameData {
     std::unique_ptr<Host> host;
+    ModeMetrics *metrics;
     int move = 0;
 };
 
+struct LoopProbe {
+    Histogram &lag;
+    Counter &stalls;
+    uint64_t last_ns = NowNs();
+};
+
 struct UserData {
     std::string id;
+    std::string mode;
     GameData *game;
+    ModeMetrics *metrics;
+    bool binary = false;
+    std::unordered_map<uint32_t, GameData> binary_games;
 };
 
+bool HasProtocol(std::string_view header, std::string_view protocol) {
+    while (!header.empty()) {
+        size_t comma = std::min(header.find(','), header.size());
+        std::string_view token = header.substr(0, comma);
+        header.remove_prefix(std::min(comma + 1, header.size()));
+        while (!token.empty() && (token.front() == ' ' || token.front() == '\t')) {
+            token.remove_prefix(1);
+        }
+        while (!token.empty() && (token.back() == ' ' || token.back() == '\t')) {
+            token.remove_suffix(1);
+        }
+        if (token == protocol) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::unique_ptr<Host> MakeHost(std::string_view mode, std::mt19937::result_type seed) {
+    if (mode == "random") {
+        return std::make_unique<HostRandom>(seed);
+    } else if (mode == "hater") {
+        return std::make_unique<HostHater>(0.2, seed);
+    }
+    return nullptr;
+}
+
+u_char MakeMove(GameData &game, size_t guess_id, ModeMetrics &metrics) {
+    uint64_t start_ns = NowNs();
+    u_char pat = game.host->OnGuess(guess_id);
+    metrics.move_latency.RecordSince(start_ns);
+    ++game.move;
+    if (pat == WIN_PAT) {
+        metrics.games_won.Add();
+    } else if (game.move == MAX_MOVES) {
+        metrics.games_lost.Add();
+    }
+    return pat;
+}
+
+bool IsGameOver(const GameData &game, u_char pat) {
+    return game.move == MAX_MOVES || pat == WIN_PAT;
+}
+
 std::string ReadFile(const std::string &filename) {
     std::ifstream fin(filename);
     std::stringstream buffer;
@@ -30,58 +137,172 @@ std::string ReadFile(const std::string &filename) {
     return buffer.str();
 }
 
+auto ServeFile(Histogram &latency, const std::string &content_type, const std::string &filename) {
+    return [&latency, content_type, filename](auto *res, auto *req) {
+        uint64_t start_ns = NowNs();
+        res->writeHeader("Content-Type", content_type)->end(ReadFile(filename));
+        latency.RecordSince(start_ns);
+    };
+}
+
 int main() {
     ReadWords();
     std::unordered_map<std::string, GameData> games;
-    uWS::App().get("/", [&](auto *res, auto *req) {
-        res->writeHeader("Content-Type", "text/html")->end(ReadFile("static/index.html"));
-    }).get("/main.css", [&](auto *res, auto *req) {
-        res->writeHeader("Content-Type", "text/css")->end(ReadFile("static/main.css"));
-    }).get("/main.js", [&](auto *res, auto *req) {
-        res->writeHeader("Content-Type", "application/javascript")->end(ReadFile("static/main.js"));
-    }).get("/favicon.ico", [&](auto *res, auto *req) {
-        res->writeHeader("Content-Type", "image/x-icon")->end(ReadFile("static/favicon.ico"));
+    std::mt19937 host_rnd(std::random_device{}());
+    Metrics metrics;
+    ModeMetrics random_metrics(metrics, "random"), hater_metrics(metrics, "hater");
+    auto get_mode_metrics = [&](std::string_view mode) -> ModeMetrics * {
+        return mode == "random" ? &random_metrics : mode == "hater" ? &hater_metrics : nullptr;
+    };
+    Gauge &active_sessions = metrics.AddGauge("wordle_ws_active_sessions");
+    Gauge &active_games = metrics.AddGauge("wordle_active_games");
+    Counter &binary_guesses = metrics.AddCounter("wordle_binary_guesses_total");
+    Counter &rejected_upgrades = metrics.AddCounter("wordle_ws_rejected_upgrades_total");
+    Histogram &not_found_latency = metrics.AddHistogram("wordle_http_seconds", "route=\"/*\"");
+    Histogram &metrics_latency = metrics.AddHistogram("wordle_http_seconds", "route=\"/metrics\"");
+    LoopProbe loop_probe{.lag = metrics.AddHistogram("wordle_loop_lag_seconds"),
+                         .stalls = metrics.AddCounter("wordle_loop_stalls_total")};
+
+    us_timer_t *probe_timer = us_create_timer((us_loop_t *) uWS::Loop::get(), 0, sizeof(LoopProbe *));
+    *(LoopProbe **) us_timer_ext(probe_timer) = &loop_probe;
+    us_timer_set(probe_timer, [](us_timer_t *timer) {
+        LoopProbe &probe = **(LoopProbe **) us_timer_ext(timer);
+        uint64_t now_ns = NowNs();
+        uint64_t expected_ns = LOOP_PROBE_MS * 1'000'000ull;
+        uint64_t lag_ns = now_ns - probe.last_ns > expected_ns ? now_ns - probe.last_ns - expected_ns : 0;
+        probe.lag.Record(lag_ns);
+        if (lag_ns >= LOOP_STALL_NS) {
+            probe.stalls.Add();
+        }
+        probe.last_ns = now_ns;
+    }, LOOP_PROBE_MS, LOOP_PROBE_MS);
+
+    uWS::App().get("/", ServeFile(metrics.AddHistogram("wordle_http_seconds", "route=\"/\""),
+                                  "text/html", "static/index.html")
+    ).get("/main.css", ServeFile(metrics.AddHistogram("wordle_http_seconds", "route=\"/main.css\""),
+                                 "text/css", "static/main.css")
+    ).get("/main.js", ServeFile(metrics.AddHistogram("wordle_http_seconds", "route=\"/main.js\""),
+                                "application/javascript", "static/main.js")
+    ).get("/favicon.ico", ServeFile(metrics.AddHistogram("wordle_http_seconds", "route=\"/favicon.ico\""),
+                                    "image/x-icon", "static/favicon.ico")
+    ).get("/metrics", [&](auto *res, auto *req) {
+        uint64_t start_ns = NowNs();
+        res->writeHeader("Content-Type", "text/plain; version=0.0.4")->end(metrics.Render());
+        metrics_latency.RecordSince(start_ns);
     }).get("/*", [&](auto *res, auto *req) {
+        uint64_t start_ns = NowNs();
         res->writeStatus("404 Not Found")->end();
+        not_found_latency.RecordSince(start_ns);
     }).ws<UserData>("/:mode/:id", {
+            .maxPayloadLength = BINARY_MAX_GUESSES * BINARY_GUESS_SIZE,
+            .maxBackpressure = BINARY_MAX_BACKPRESSURE,
             .upgrade = [&](auto *res, auto *req, auto *context) {
-                std::unique_ptr<Host> host;
-                if (req->getParameter(0) == "random") {
-                    host = std::make_unique<HostRandom>();
-                } else if (req->getParameter(0) == "hater") {
-                    host = std::make_unique<HostHater>(0.2);
-                } else {
+                uint64_t start_ns = NowNs();
+                std::string mode(req->getParameter(0));
+                ModeMetrics *mode_metrics = get_mode_metrics(mode);
+                if (!mode_metrics) {
                     res->writeStatus("404 Not Found")->end();
+                    rejected_upgrades.Add();
                     return;
                 }
                 std::string id(req->getParameter(1));
-                auto it = games.find(id);
-                if (it == games.end()) {
-                    it = games.insert({id, GameData{.host = std::move(host)}}).first;
+                std::string_view protocol = req->getHeader("sec-websocket-protocol");
+                bool binary = HasProtocol(protocol, BINARY_PROTOCOL);
+                GameData *game = nullptr;
+                if (!binary) {
+                    auto it = games.find(id);
+                    if (it == games.end()) {
+                        it = games.insert({id, GameData{.host = MakeHost(mode, host_rnd()), .metrics = mode_metrics}}).first;
+                        mode_metrics->games_started.Add();
+                        active_games.Add(1);
+                    }
+                    game = &it->second;
+                    mode_metrics = game->metrics;
                 }
-                res->template upgrade<UserData>({.id = id, .game = &it->second},
+                res->template upgrade<UserData>({.id = id, .mode = mode, .game = game,
+                                                 .metrics = mode_metrics, .binary = binary},
                                                 req->getHeader("sec-websocket-key"),
-                                                req->getHeader("sec-websocket-protocol"),
+                                                binary ? std::string_view(BINARY_PROTOCOL) : protocol,
                                                 req->getHeader("sec-websocket-extensions"),
                                                 context);
+                mode_metrics->upgrade_latency.RecordSince(start_ns);
+            },
+            .open = [&](auto *ws) {
+                active_sessions.Add(1);
             },
             .message = [&](auto *ws, std::string_view message, uWS::OpCode op_code) {
-                auto &[host, move] = *ws->getUserData()->game;
+                uint64_t start_ns = NowNs();
+                UserData &data = *ws->getUserData();
+                ModeMetrics &mode_metrics = *data.metrics;
+                if (data.binary) {
+                    if (op_code != uWS::OpCode::BINARY || message.empty() || message.size() % BINARY_GUESS_SIZE != 0) {
+                        ws->end(1002, "malformed binary frame");
+                        return;
+                    }
+                    std::string reply(message.size() / BINARY_GUESS_SIZE * BINARY_RESULT_SIZE, '\0');
+                    for (size_t i = 0, j = 0; i < message.size(); i += BINARY_GUESS_SIZE, j += BINARY_RESULT_SIZE) {
+                        auto byte = [&](size_t k) { return uint32_t(u_char(message[i + k])); };
+                        uint32_t game_id = byte(0) | byte(1) << 8 | byte(2) << 16 | byte(3) << 24;
+                        size_t guess_id = byte(4) | byte(5) << 8;
+                        u_char pat = INVALID_PAT;
+                        uint16_t answer = NO_ANSWER;
+                        auto it = data.binary_games.find(game_id);
+                        if (guess_id == NEW_GAME_GUESS) {
+                            if (it != data.binary_games.end()) {
+                                it->second = GameData{.host = MakeHost(data.mode, host_rnd()), .metrics = data.metrics};
+                                mode_metrics.games_started.Add();
+                                pat = GAME_STARTED_PAT;
+                            } else if (data.binary_games.size() >= BINARY_MAX_GAMES) {
+                                pat = GAME_LIMIT_PAT;
+                            } else {
+                                data.binary_games.insert({game_id, GameData{.host = MakeHost(data.mode, host_rnd()), .metrics = data.metrics}});
+                                mode_metrics.games_started.Add();
+                                active_games.Add(1);
+                                pat = GAME_STARTED_PAT;
+                            }
+                        } else if (guess_id >= guesses.size() || it == data.binary_games.end()) {
+                            mode_metrics.invalid_guesses.Add();
+                        } else {
+                            pat = MakeMove(it->second, guess_id, mode_metrics);
+                            if (IsGameOver(it->second, pat)) {
+                                answer = answer2guess[it->second.host->GetAnswer()];
+                                data.binary_games.erase(it);
+                                active_games.Add(-1);
+                            }
+                        }
+                        std::copy_n(message.begin() + i, 4, reply.begin() + j);
+                        reply[j + 4] = char(pat);
+                        reply[j + 5] = char(answer & 0xff);
+                        reply[j + 6] = char(answer >> 8);
+                    }
+                    if (ws->send(reply, uWS::OpCode::BINARY) == uWS::WebSocket<false, true, UserData>::DROPPED) {
+                        ws->end(1008, "backpressure limit exceeded");
+                    }
+                    binary_guesses.Add(message.size() / BINARY_GUESS_SIZE);
+                    mode_metrics.binary_message_latency.RecordSince(start_ns);
+                    return;
+                }
+                GameData &game = *data.game;
                 size_t guess_id = std::find(guesses.begin(), guesses.end(), message) - guesses.begin();
                 if (guess_id == guesses.size()) {
                     ws->send("", op_code);
-                } else if (move < MAX_MOVES) {
-                    u_char pat = host->OnGuess(guess_id);
+                    mode_metrics.invalid_guesses.Add();
+                } else if (game.move < MAX_MOVES) {
+                    u_char pat = MakeMove(game, guess_id, mode_metrics);
                     std::string pattern = DecodePattern(pat);
                     ws->send(pattern, op_code);
-                    ++move;
-                    if (move == MAX_MOVES && pat != WIN_PAT) {
-                        ws->send("!" + answers[host->GetAnswer()], op_code);
+                    if (game.move == MAX_MOVES && pat != WIN_PAT) {
+                        ws->send("!" + answers[game.host->GetAnswer()], op_code);
                     }
-                    if (move == MAX_MOVES || pat == WIN_PAT) {
-                        games.erase(ws->getUserData()->id);
+                    if (IsGameOver(game, pat) && games.erase(data.id)) {
+                        active_games.Add(-1);
                     }
                 }
+                mode_metrics.message_latency.RecordSince(start_ns);
+            },
+            .close = [&](auto *ws, int code, std::string_view message) {
+                active_sessions.Add(-1);
+                active_games.Add(-int64_t(ws->getUserData()->binary_games.size()));
             }
     }).listen(PORT, [](auto *listen_socket) {
         if (listen_socket) {